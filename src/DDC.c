@@ -15,6 +15,12 @@
 #define kMaxRequests 10
 #endif
 
+#ifdef SIMULATE
+#define DDCLog(...) (void)0 // the soak counts failures itself, per-retry chatter would bury its report
+#else
+#define DDCLog printf
+#endif
+
 #ifndef _IOKIT_IOFRAMEBUFFER_H
 #define kIOFBDependentIDKey	"IOFBDependentID"
 #define kIOFBDependentIndexKey	"IOFBDependentIndex"
@@ -167,10 +173,169 @@ dispatch_semaphore_t I2CRequestQueue(io_service_t i2c_device_id) {
     return queue;
 }
 
-bool FramebufferI2CRequest(io_service_t framebuffer, IOI2CRequest *request) {
+#ifdef SIMULATE
+/*
+ Simulated monitor on a noisy bus, for soak-testing the retry logic in DDCRead and DDCTableRead without hardware.
+ Writes always land, but only take effect up to DDCSimulatedSettleTime later.
+ Reply transactions are faulted with probability DDCFaultRate.
+ Every transaction costs bus time: its bytes at DDCSimulatedByteTime each, plus minReplyDelay before a reply,
+ and a dropped reply costs DDCSimulatedTimeout on top, as the host has to give up waiting for it.
+ */
+double DDCFaultRate = 0;
+UInt64 DDCFaultsInjected[kDDCFaultCount] = {};
+UInt16 DDCSimulatedVCP[256] = {};
+UInt16 DDCSimulatedMax[256] = {};
+UInt8 DDCSimulatedTable[256][1024] = {};
+UInt16 DDCSimulatedTableLength[256] = {};
+long DDCSimulatedByteTime = 90; // usecs, 9 clocks per byte at 100kHz
+long DDCSimulatedTimeout = 50000; // usecs
+long DDCSimulatedSettleTime = 0; // usecs, a write takes up to this long to be applied
+UInt16 DDCSimulatedPending[256] = {};
+uint64_t DDCSimulatedApplyAt[256] = {}; // uptime in nanosecs, 0 when nothing is pending
+
+void DDCSimulatedSet(UInt8 control_id, UInt16 value, UInt16 max) {
+    DDCSimulatedVCP[control_id] = value;
+    DDCSimulatedMax[control_id] = max;
+    DDCSimulatedApplyAt[control_id] = 0;
+}
+
+UInt16 SimulatedVCP(UInt8 control_id) {
+    if (DDCSimulatedApplyAt[control_id] && clock_gettime_nsec_np(CLOCK_UPTIME_RAW) >= DDCSimulatedApplyAt[control_id]) {
+        DDCSimulatedVCP[control_id] = DDCSimulatedPending[control_id];
+        DDCSimulatedApplyAt[control_id] = 0;
+    }
+    return DDCSimulatedVCP[control_id];
+}
+
+void SimulatedBusTime(IOI2CRequest *request, UInt32 bytes) {
+    long busy = bytes * DDCSimulatedByteTime;
+    if (request->replyTransactionType != kIOI2CNoTransactionType)
+        busy += request->minReplyDelay / 1000;
+    if (busy > 0)
+        usleep((useconds_t) busy);
+}
+
+bool SimulatedI2CSendRequest(IOI2CRequest *request) {
+    UInt8 *data = (UInt8 *) request->sendBuffer;
+    UInt8 *reply_data = (UInt8 *) request->replyBuffer;
+    UInt8 reply[39]; // longest reply is a Table Read fragment: 6 bytes of framing and 32 of table
+    UInt32 reply_length = 0;
+    UInt16 offset = (data[4] << 8) | data[5];
+    UInt8 fragment = 0;
+    UInt8 checksum = 0x6E;
+
+    request->result = kIOReturnSuccess;
+    if (request->sendAddress != 0x6E || request->sendBytes < 5) { // only DDC/CI is simulated
+        SimulatedBusTime(request, request->sendBytes);
+        request->result = kIOReturnUnsupported;
+        return true;
+    }
+    for (UInt32 i = 0; i + 1 < request->sendBytes; i++)
+        checksum ^= data[i];
+    if (checksum != data[request->sendBytes - 1]) { // a garbled request is ignored by the monitor
+        SimulatedBusTime(request, request->sendBytes);
+        request->replyBytes = 0;
+        request->result = kIOReturnNotResponding;
+        return false;
+    }
+
+    switch (data[2]) {
+        case 0x03: // Set VCP Feature
+            SimulatedBusTime(request, request->sendBytes);
+            DDCSimulatedPending[data[3]] = (data[4] << 8) | data[5];
+            DDCSimulatedApplyAt[data[3]] = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) + 1000 * (uint64_t) arc4random_uniform((UInt32) DDCSimulatedSettleTime + 1);
+            return true;
+        case 0xE7: // Table Write, each fragment ends the table
+            SimulatedBusTime(request, request->sendBytes);
+            fragment = (data[1] & 0x7F) - 4;
+            if ((data[1] & 0x7F) >= 4 && fragment <= 32 && offset + fragment <= sizeof(DDCSimulatedTable[0])) {
+                memcpy(&DDCSimulatedTable[data[3]][offset], &data[6], fragment);
+                DDCSimulatedTableLength[data[3]] = offset + fragment;
+            }
+            return true;
+        case 0x01: // Get VCP Feature
+            reply[0] = 0x6E;
+            reply[1] = 0x88;
+            reply[2] = 0x02;
+            reply[3] = 0x00;
+            reply[4] = data[3];
+            reply[5] = 0x00;
+            reply[6] = DDCSimulatedMax[data[3]] >> 8;
+            reply[7] = DDCSimulatedMax[data[3]] & 255;
+            reply[8] = SimulatedVCP(data[3]) >> 8;
+            reply[9] = DDCSimulatedVCP[data[3]] & 255;
+            reply_length = 11;
+            break;
+        case 0xE2: // Table Read, an empty fragment past the end of the table
+            if (offset < DDCSimulatedTableLength[data[3]])
+                fragment = MIN(32, DDCSimulatedTableLength[data[3]] - offset);
+            reply[0] = 0x6E;
+            reply[1] = 0x80 | (3 + fragment);
+            reply[2] = 0xE4;
+            reply[3] = data[4];
+            reply[4] = data[5];
+            memcpy(&reply[5], &DDCSimulatedTable[data[3]][offset], fragment);
+            reply_length = 6 + fragment;
+            break;
+        default:
+            break;
+    }
+    if (!reply_length || request->replyBytes < reply_length) {
+        SimulatedBusTime(request, request->sendBytes);
+        request->result = kIOReturnUnsupported;
+        return true;
+    }
+    reply[reply_length - 1] = request->replyAddress ^ request->replySubAddress;
+    for (UInt32 i = 1; i < reply_length - 1; i++)
+        reply[reply_length - 1] ^= reply[i];
+
+    enum DDCFault fault = kDDCFaultNone;
+    if (arc4random_uniform(1000000) < DDCFaultRate * 1000000)
+        fault = 1 + arc4random_uniform(kDDCFaultCount - 1);
+    DDCFaultsInjected[fault]++;
+
+    switch (fault) {
+        case kDDCFaultDrop: // monitor never answered
+            SimulatedBusTime(request, request->sendBytes);
+            usleep((useconds_t) DDCSimulatedTimeout);
+            request->replyBytes = 0;
+            request->result = kIOReturnNotResponding;
+            return false;
+        case kDDCFaultChecksum: // line noise: flip one bit in one or two bytes of the payload
+            for (int flips = 1 + arc4random_uniform(2); flips > 0; flips--)
+                reply[5 + arc4random_uniform(reply_length - 5)] ^= 1 << arc4random_uniform(8);
+            break;
+        case kDDCFaultOpcode: // well-formed reply to some other request
+            reply[reply_length - 1] ^= 0x01;
+            reply[2] ^= 0x01;
+            break;
+        case kDDCFaultTruncate: // short read, tail of the buffer keeps whatever was there before
+            request->replyBytes = 1 + arc4random_uniform(reply_length - 1);
+            SimulatedBusTime(request, request->sendBytes + request->replyBytes);
+            memcpy(reply_data, reply, request->replyBytes);
+            return true;
+        case kDDCFaultUnsupported:
+            SimulatedBusTime(request, request->sendBytes);
+            request->replyBytes = 0;
+            request->result = kIOReturnUnsupportedMode;
+            return true;
+        default:
+            break;
+    }
+    SimulatedBusTime(request, request->sendBytes + reply_length);
+    memcpy(reply_data, reply, reply_length);
+    request->replyBytes = reply_length;
+    return true;
+}
+#endif
+
+bool FramebufferI2CRequestSettle(io_service_t framebuffer, IOI2CRequest *request, useconds_t settle) {
     dispatch_semaphore_t queue = I2CRequestQueue(framebuffer);
     dispatch_semaphore_wait(queue, DISPATCH_TIME_FOREVER);
     bool result = false;
+#ifdef SIMULATE
+    result = SimulatedI2CSendRequest(request);
+#else
     IOItemCount busCount;
     if (IOFBGetI2CInterfaceCount(framebuffer, &busCount) == KERN_SUCCESS) {
         IOOptionBits bus = 0;
@@ -188,26 +353,35 @@ bool FramebufferI2CRequest(io_service_t framebuffer, IOI2CRequest *request) {
             if (result) break;
         }
     }
-    if (request->replyTransactionType == kIOI2CNoTransactionType)
-        usleep(20000);
+#endif
+    if (settle)
+        usleep(settle);
     dispatch_semaphore_signal(queue);
     return result && request->result == KERN_SUCCESS;
 }
 
+bool FramebufferI2CRequest(io_service_t framebuffer, IOI2CRequest *request) {
+    // give the monitor time to act on a bare write before anyone else talks to it
+    return FramebufferI2CRequestSettle(framebuffer, request, request->replyTransactionType == kIOI2CNoTransactionType ? 20000 : 0);
+}
+
 long DDCDelay(io_service_t framebuffer) {
     // Certain displays / graphics cards require a long-enough delay to yield a response to DDC commands
     // Relying on retry will not help if the delay is too short.
     // kernel panics are possible if value is wrong
     // https://developer.apple.com/documentation/iokit/ioi2crequest/1410394-minreplydelay?language=objc
-
+#ifdef SIMULATE
+    return DDCDelayBase;
+#else
     CFStringRef ioRegPath = IORegistryEntryCopyPath(framebuffer,  kIOServicePlane);
     if (CFStringFind(ioRegPath, CFSTR("/AMD"), kCFCompareCaseInsensitive).location != kCFNotFound) {
         return DDCDelayBase + 30000000; // Team Red needs more time, as usual!
     }
     return DDCDelayBase;
+#endif
 }
 
-bool DDCWrite(io_service_t framebuffer, struct DDCWriteCommand *write) {
+bool DDCWriteRequest(io_service_t framebuffer, struct DDCWriteCommand *write, useconds_t settle) {
     IOI2CRequest    request;
     UInt8           data[128];
 
@@ -224,14 +398,61 @@ bool DDCWrite(io_service_t framebuffer, struct DDCWriteCommand *write) {
     data[1] = 0x84;
     data[2] = 0x03;
     data[3] = write->control_id;
-    data[4] = (write->new_value) >> 8;
+    data[4] = write->new_value >> 8;
     data[5] = write->new_value & 255;
     data[6] = 0x6E ^ data[0] ^ data[1] ^ data[2] ^ data[3]^ data[4] ^ data[5];
 
     request.replyTransactionType            = kIOI2CNoTransactionType;
     request.replyBytes                      = 0;
 
-    bool result = FramebufferI2CRequest(framebuffer, &request);
+    bool result = FramebufferI2CRequestSettle(framebuffer, &request, settle);
+    return result;
+}
+
+bool DDCWrite(io_service_t framebuffer, struct DDCWriteCommand *write) {
+    return DDCWriteRequest(framebuffer, write, 20000);
+}
+
+UInt32 DDCReplyTransactionType(void) {
+#ifdef TT_SIMPLE
+    return kIOI2CSimpleTransactionType;
+#elif defined TT_DDC || defined SIMULATE
+    return kIOI2CDDCciReplyTransactionType;
+#else
+    return SupportedTransactionType();
+#endif
+}
+
+bool DDCReadRequest(io_service_t framebuffer, struct DDCReadCommand *read, IOI2CRequest *request, UInt8 reply_data[11], long reply_timeout) {
+    UInt8 data[128];
+
+    bzero(request, sizeof(*request));
+
+    request->commFlags                      = 0;
+    request->sendAddress                    = 0x6E;
+    request->sendTransactionType            = kIOI2CSimpleTransactionType;
+    request->sendBuffer                     = (vm_address_t) &data[0];
+    request->sendBytes                      = 5;
+    request->minReplyDelay                  = reply_timeout;
+    data[0] = 0x51;
+    data[1] = 0x82;
+    data[2] = 0x01;
+    data[3] = read->control_id;
+    data[4] = 0x6E ^ data[0] ^ data[1] ^ data[2] ^ data[3];
+    request->replyTransactionType   = DDCReplyTransactionType();
+    request->replyAddress           = 0x6F;
+    request->replySubAddress        = 0x51;
+
+    request->replyBuffer = (vm_address_t) reply_data;
+    request->replyBytes = 11;
+
+    bool result = FramebufferI2CRequest(framebuffer, request);
+    result = (result && reply_data[0] == request->sendAddress && reply_data[2] == 0x2 && reply_data[4] == read->control_id && reply_data[10] == (request->replyAddress ^ request->replySubAddress ^ reply_data[1] ^ reply_data[2] ^ reply_data[3] ^ reply_data[4] ^ reply_data[5] ^ reply_data[6] ^ reply_data[7] ^ reply_data[8] ^ reply_data[9]));
+
+    if (result) { // checksum is ok
+        read->max_value = (reply_data[6] << 8) | reply_data[7];
+        read->current_value = (reply_data[8] << 8) | reply_data[9];
+    }
     return result;
 }
 
@@ -239,67 +460,203 @@ bool DDCRead(io_service_t framebuffer, struct DDCReadCommand *read) {
     IOI2CRequest request;
     UInt8 reply_data[11] = {};
     bool result = false;
-    UInt8 data[128];
 
     long reply_timeout = DDCDelay(framebuffer) * kNanosecondScale;
 
     for (int i=1; i<=kMaxRequests; i++) {
-        bzero(&request, sizeof(request));
-
-        request.commFlags                       = 0;
-        request.sendAddress                     = 0x6E;
-        request.sendTransactionType             = kIOI2CSimpleTransactionType;
-        request.sendBuffer                      = (vm_address_t) &data[0];
-        request.sendBytes                       = 5;
-        request.minReplyDelay                   = reply_timeout;
-        data[0] = 0x51;
-        data[1] = 0x82;
-        data[2] = 0x01;
-        data[3] = read->control_id;
-        data[4] = 0x6E ^ data[0] ^ data[1] ^ data[2] ^ data[3];
-#ifdef TT_SIMPLE
-        request.replyTransactionType    = kIOI2CSimpleTransactionType;
-#elif defined TT_DDC
-        request.replyTransactionType    = kIOI2CDDCciReplyTransactionType;
-#else
-        request.replyTransactionType    = SupportedTransactionType();
-#endif
-        request.replyAddress            = 0x6F;
-        request.replySubAddress         = 0x51;
-
-        request.replyBuffer = (vm_address_t) reply_data;
-        request.replyBytes = sizeof(reply_data);
+        result = DDCReadRequest(framebuffer, read, &request, reply_data, reply_timeout);
 
-        result = FramebufferI2CRequest(framebuffer, &request);
-        result = (result && reply_data[0] == request.sendAddress && reply_data[2] == 0x2 && reply_data[4] == read->control_id && reply_data[10] == (request.replyAddress ^ request.replySubAddress ^ reply_data[1] ^ reply_data[2] ^ reply_data[3] ^ reply_data[4] ^ reply_data[5] ^ reply_data[6] ^ reply_data[7] ^ reply_data[8] ^ reply_data[9]));
-
-        if (result) { // checksum is ok
+        if (result) {
             if (i > 1) {
-                printf("D: Tries required to get data: %d (%ldns reply-timeout)\n", i, reply_timeout);
+                DDCLog("D: Tries required to get data: %d (%ldns reply-timeout)\n", i, reply_timeout);
             }
             break;
         }
 
         if (request.result == kIOReturnUnsupportedMode)
-            printf("E: Unsupported Transaction Type! \n");
+            DDCLog("E: Unsupported Transaction Type! \n");
 
         // reset values and return 0, if data reading fails
         if (i >= kMaxRequests) {
             read->success = false;
             read->max_value = 0;
             read->current_value = 0;
-            printf("E: No data after %d tries! (%ldns reply-timeout)\n", i, reply_timeout);
+            DDCLog("E: No data after %d tries! (%ldns reply-timeout)\n", i, reply_timeout);
             return 0;
         }
 
         usleep(40000); // 40msec -> See DDC/CI Vesa Standard - 4.4.1 Communication Error Recovery
     }
     read->success = true;
-    read->max_value = reply_data[7];
-    read->current_value = reply_data[9];
     return result;
 }
 
+bool DDCWriteConfirmed(io_service_t framebuffer, struct DDCWriteCommand *write, long deadline, long *settle_time, bool *settled) {
+    // instead of sleeping blindly after the write, poll the control until it reads back the new value
+    IOI2CRequest request;
+    UInt8 reply_data[11] = {};
+    struct DDCReadCommand read = {};
+    long reply_timeout = DDCDelay(framebuffer) * kNanosecondScale;
+    long wait = 5000; // usecs, doubled while the monitor still answers with the old value
+    // a Get VCP round trip is budgeted at no less than the 40msec a monitor may take to answer,
+    // then at the slowest poll seen; a poll slower than all before it can still overrun the deadline
+    long poll_time = MAX(reply_timeout / 1000, 40000);
+    uint64_t start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+
+    *settle_time = 0;
+    *settled = false;
+    if (!DDCWriteRequest(framebuffer, write, 0))
+        return false;
+
+    read.control_id = write->control_id;
+    for (;;) {
+        *settle_time = (long) ((clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start) / 1000);
+        if (*settle_time + wait + poll_time > deadline)
+            break; // the next poll could not finish before the deadline
+
+        usleep((useconds_t) wait);
+        uint64_t poll_start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+        bool result = DDCReadRequest(framebuffer, &read, &request, reply_data, reply_timeout);
+        uint64_t poll_end = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+        poll_time = MAX(poll_time, (long) ((poll_end - poll_start) / 1000));
+
+        // a monitor clamps values past its maximum, and that is as settled as it will get
+        if (result && (read.current_value == write->new_value ||
+                       (write->new_value > read.max_value && read.current_value == read.max_value))) {
+            *settle_time = (long) ((poll_end - start) / 1000);
+            *settled = true;
+            break;
+        }
+        if (result)
+            wait = MIN(wait * 2, 40000);
+        else
+            wait = 40000; // 40msec -> See DDC/CI Vesa Standard - 4.4.1 Communication Error Recovery
+    }
+    return true;
+}
+
+bool DDCTableRead(io_service_t framebuffer, struct DDCTableCommand *table) {
+    IOI2CRequest request;
+    UInt8 data[128];
+    UInt8 reply_data[39]; // 0x6E, length, 0xE4, offset (2 bytes), up to 32 bytes of table, checksum
+    UInt16 offset = 0;
+
+    long reply_timeout = DDCDelay(framebuffer) * kNanosecondScale;
+
+    table->success = false;
+    table->truncated = false;
+    for (;;) {
+        UInt8 fragment = 0;
+        bool result = false;
+
+        for (int i=1; i<=kMaxRequests; i++) {
+            bzero(&request, sizeof(request));
+            bzero(reply_data, sizeof(reply_data));
+
+            request.commFlags                       = 0;
+            request.sendAddress                     = 0x6E;
+            request.sendTransactionType             = kIOI2CSimpleTransactionType;
+            request.sendBuffer                      = (vm_address_t) &data[0];
+            request.sendBytes                       = 7;
+            request.minReplyDelay                   = reply_timeout;
+            data[0] = 0x51;
+            data[1] = 0x84;
+            data[2] = 0xE2;
+            data[3] = table->control_id;
+            data[4] = offset >> 8;
+            data[5] = offset & 255;
+            data[6] = 0x6E ^ data[0] ^ data[1] ^ data[2] ^ data[3] ^ data[4] ^ data[5];
+
+            request.replyTransactionType    = DDCReplyTransactionType();
+            request.replyAddress            = 0x6F;
+            request.replySubAddress         = 0x51;
+
+            request.replyBuffer = (vm_address_t) reply_data;
+            request.replyBytes = sizeof(reply_data);
+
+            result = FramebufferI2CRequest(framebuffer, &request);
+
+            UInt8 length = reply_data[1] & 0x7F; // opcode + offset + table bytes
+            result = (result && reply_data[0] == request.sendAddress && length >= 3 && length <= 35 && request.replyBytes >= 3 + length && reply_data[2] == 0xE4 && reply_data[3] == data[4] && reply_data[4] == data[5]);
+            if (result) {
+                UInt8 checksum = request.replyAddress ^ request.replySubAddress;
+                for (int b = 1; b < 2 + length; b++)
+                    checksum ^= reply_data[b];
+                result = (checksum == reply_data[2 + length]);
+                fragment = length - 3;
+            }
+
+            if (result) break;
+
+            if (i >= kMaxRequests) {
+                DDCLog("E: No table data at offset %u after %d tries! (%ldns reply-timeout)\n", offset, i, reply_timeout);
+                table->length = offset;
+                return false;
+            }
+
+            usleep(40000); // 40msec -> See DDC/CI Vesa Standard - 4.4.1 Communication Error Recovery
+        }
+
+        if (!fragment) break; // an empty fragment marks the end of the table
+        if (offset + fragment > table->length) { // the buffer is full but the table is not, keep what fits
+            memcpy(table->data + offset, &reply_data[5], table->length - offset);
+            offset = table->length;
+            table->truncated = true;
+            break;
+        }
+        memcpy(table->data + offset, &reply_data[5], fragment);
+        offset += fragment;
+
+        usleep(40000); // give the monitor the same breather between fragments as between retries
+    }
+    table->length = offset;
+    table->success = true;
+    return true;
+}
+
+bool DDCTableWrite(io_service_t framebuffer, struct DDCTableCommand *table) {
+    IOI2CRequest request;
+    UInt8 data[128];
+    UInt16 offset = 0;
+
+    table->success = false;
+    while (offset < table->length) {
+        UInt8 fragment = MIN(32, table->length - offset);
+
+        bzero(&request, sizeof(request));
+
+        request.commFlags                       = 0;
+        request.sendAddress                     = 0x6E;
+        request.sendTransactionType             = kIOI2CSimpleTransactionType;
+        request.sendBuffer                      = (vm_address_t) &data[0];
+        request.sendBytes                       = 7 + fragment;
+
+        data[0] = 0x51;
+        data[1] = 0x80 | (4 + fragment);
+        data[2] = 0xE7;
+        data[3] = table->control_id;
+        data[4] = offset >> 8;
+        data[5] = offset & 255;
+        memcpy(&data[6], table->data + offset, fragment);
+        data[6 + fragment] = 0x6E;
+        for (int b = 0; b < 6 + fragment; b++)
+            data[6 + fragment] ^= data[b];
+
+        request.replyTransactionType            = kIOI2CNoTransactionType;
+        request.replyBytes                      = 0;
+
+        // give the monitor the same breather between fragments as between retries
+        if (!FramebufferI2CRequestSettle(framebuffer, &request, 40000)) {
+            DDCLog("E: Table write failed at offset %u!\n", offset);
+            table->length = offset;
+            return false;
+        }
+        offset += fragment;
+    }
+    table->success = true;
+    return true;
+}
+
 UInt32 SupportedTransactionType() {
    /*
      With my setup (Intel HD4600 via displaylink to 'DELL U2515H') the original app failed to read ddc and freezes my system.
@@ -68,15 +68,24 @@
 struct DDCWriteCommand
 {
     UInt8 control_id;
-    UInt8 new_value;
+    UInt16 new_value;
 };
 
 struct DDCReadCommand
 {
     UInt8 control_id;
     bool success;
-    UInt8 max_value;
-    UInt8 current_value;
+    UInt16 max_value;
+    UInt16 current_value;
+};
+
+struct DDCTableCommand
+{
+    UInt8 control_id;
+    bool success;
+    bool truncated; // the monitor had more table than fit in the buffer
+    UInt16 length; // bytes to write, or buffer size to read into; bytes read or written on return
+    UInt8 *data;
 };
 
 struct EDID {
@@ -237,10 +246,35 @@ struct EDID {
     UInt8 checksum : 8;
 };
 
+#ifdef SIMULATE
+enum DDCFault {
+    kDDCFaultNone,
+    kDDCFaultDrop,          // no reply at all
+    kDDCFaultChecksum,      // bit flips in the reply payload
+    kDDCFaultOpcode,        // valid frame, wrong opcode byte
+    kDDCFaultTruncate,      // short reply
+    kDDCFaultUnsupported,   // kIOReturnUnsupportedMode
+    kDDCFaultCount
+};
+
+extern double DDCFaultRate; // 0..1, chance a reply transaction is faulted
+extern UInt64 DDCFaultsInjected[kDDCFaultCount];
+extern UInt16 DDCSimulatedVCP[256];
+extern UInt8 DDCSimulatedTable[256][1024];
+extern UInt16 DDCSimulatedTableLength[256];
+extern long DDCSimulatedByteTime; // usecs on the wire per byte
+extern long DDCSimulatedTimeout; // usecs lost waiting for a dropped reply
+extern long DDCSimulatedSettleTime; // usecs a write may take to be applied
+void DDCSimulatedSet(UInt8 control_id, UInt16 value, UInt16 max);
+#endif
+
 extern long DDCDelayBase; // nanoseconds
 long DDCDelay(io_service_t framebuffer);
 bool DDCWrite(io_service_t framebuffer, struct DDCWriteCommand *write);
 bool DDCRead(io_service_t framebuffer, struct DDCReadCommand *read);
+bool DDCTableRead(io_service_t framebuffer, struct DDCTableCommand *table);
+bool DDCTableWrite(io_service_t framebuffer, struct DDCTableCommand *table);
+bool DDCWriteConfirmed(io_service_t framebuffer, struct DDCWriteCommand *write, long deadline, long *settle_time, bool *settled); // microseconds
 bool EDIDTest(io_service_t framebuffer, struct EDID *edid);
 UInt32 SupportedTransactionType(void);
 io_service_t IOFramebufferPortFromCGDisplayID(CGDirectDisplayID displayID, CFStringRef displayLocation);
@@ -28,6 +28,7 @@ int blacklistedDeviceWithNumber;
 #ifdef OSD
 bool useOsd;
 #endif
+long confirmDeadline = 0; // usecs, 0 sends writes blind
 
 extern io_service_t CGDisplayIOServicePort(CGDirectDisplayID display) __attribute__((weak_import));
 
@@ -93,15 +94,43 @@ uint getControl(CGDirectDisplayID cdisplay, uint control_id)
     return command.current_value;
 }
 
-/* Set new value for control from display */
-void setControl(io_service_t framebuffer, uint control_id, uint new_value)
+/* Resets are commands rather than settings, they never read back what was written */
+bool isWriteOnly(uint control_id)
 {
+    switch (control_id) {
+        case RESET:
+        case RESET_BRIGHTNESS_AND_CONTRAST:
+        case RESET_GEOMETRY:
+        case RESET_COLOR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Set new value for control from display, returns true if the display confirmed it */
+bool setControl(io_service_t framebuffer, uint control_id, uint new_value)
+{
+    if (new_value > 0xFFFF) {
+        MyLog(@"E: VCP control #%u value %u does not fit in 16 bits", control_id, new_value);
+        return false;
+    }
     struct DDCWriteCommand command;
     command.control_id = control_id;
     command.new_value = new_value;
+    bool confirmed = false;
 
     MyLog(@"D: setting VCP control #%u => %u", command.control_id, command.new_value);
-    if (!DDCWrite(framebuffer, &command)){
+    if (confirmDeadline > 0 && !isWriteOnly(control_id)) {
+        long settle_time = 0;
+        if (!DDCWriteConfirmed(framebuffer, &command, confirmDeadline, &settle_time, &confirmed)) {
+            MyLog(@"E: Failed to send DDC command!");
+        } else if (confirmed) {
+            MyLog(@"I: VCP control #%u settled at %u after %ldus", command.control_id, command.new_value, settle_time);
+        } else {
+            MyLog(@"E: VCP control #%u not confirmed at %u after %ldus", command.control_id, command.new_value, settle_time);
+        }
+    } else if (!DDCWrite(framebuffer, &command)){
         MyLog(@"E: Failed to send DDC command!");
     }
 #ifdef OSD
@@ -127,10 +156,11 @@ void setControl(io_service_t framebuffer, uint control_id, uint new_value)
         }
     }
 #endif
+    return confirmed;
 }
 
 /* Get current value to Set relative value for control from display */
-void getSetControl(io_service_t framebuffer, uint control_id, NSString *new_value, NSString *operator)
+bool getSetControl(io_service_t framebuffer, uint control_id, NSString *new_value, NSString *operator)
 {
     struct DDCReadCommand command;
     command.control_id = control_id;
@@ -155,9 +185,201 @@ void getSetControl(io_service_t framebuffer, uint control_id, NSString *new_valu
     // validate and write
     int clamped_value = MIN(MAX(set_value.intValue, 0), command.max_value);
     MyLog(@"D: relative setting: %@ = %d (clamped to 0, %d)", formula, clamped_value, command.max_value);
-    setControl(framebuffer, control_id, (uint) clamped_value);
+    return setControl(framebuffer, control_id, (uint) clamped_value);
 }
 
+/* Read a table-type control from display in 32 byte fragments */
+void getTable(io_service_t framebuffer, uint control_id)
+{
+    UInt8 data[4096];
+    struct DDCTableCommand command;
+    command.control_id = control_id;
+    command.length = sizeof(data);
+    command.data = data;
+    MyLog(@"D: querying VCP table: #%u =?", command.control_id);
+
+    if (!DDCTableRead(framebuffer, &command)) {
+        MyLog(@"E: DDC table read failed after %u bytes!", command.length);
+        return;
+    }
+    NSMutableString *hex = [NSMutableString stringWithCapacity:command.length * 2];
+    for (UInt16 i = 0; i < command.length; i++)
+        [hex appendFormat:@"%02x", data[i]];
+    MyLog(@"I: VCP table #%u (0x%02hhx) = %u bytes: %@", command.control_id, command.control_id, command.length, hex);
+    if (command.truncated)
+        MyLog(@"E: VCP table #%u is longer than %lu bytes, the rest was not read!", command.control_id, sizeof(data));
+}
+
+/* Write a table-type control to display from a hex string */
+void setTable(io_service_t framebuffer, uint control_id, NSString *new_value)
+{
+    UInt8 data[4096];
+    struct DDCTableCommand command;
+    command.control_id = control_id;
+    command.data = data;
+
+    if (!new_value.length || new_value.length % 2 || new_value.length / 2 > sizeof(data)) {
+        MyLog(@"E: VCP table value must be an even number of hex digits, 1 to %lu bytes", sizeof(data));
+        return;
+    }
+    // scanHexInt alone would skip whitespace, a 0x prefix and trailing junk
+    NSCharacterSet *notHex = [[NSCharacterSet characterSetWithCharactersInString:@"0123456789abcdefABCDEF"] invertedSet];
+    if ([new_value rangeOfCharacterFromSet:notHex].location != NSNotFound) {
+        MyLog(@"E: VCP table value is not hex: %@", new_value);
+        return;
+    }
+    command.length = new_value.length / 2;
+    for (UInt16 i = 0; i < command.length; i++) {
+        unsigned int byte;
+        [[NSScanner scannerWithString:[new_value substringWithRange:NSMakeRange(i * 2, 2)]] scanHexInt:&byte];
+        data[i] = byte;
+    }
+
+    MyLog(@"D: setting VCP table #%u => %u bytes", command.control_id, command.length);
+    if (!DDCTableWrite(framebuffer, &command)) {
+        MyLog(@"E: Failed to send DDC table at offset %u!", command.length);
+    }
+}
+
+#ifdef SIMULATE
+int compareLatency(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Soak DDCRead, confirmed writes and table transfers against the simulated bus at increasing fault rates */
+int soak(NSUInteger ops)
+{
+    const double rates[] = {0, 0.01, 0.05, 0.1, 0.2, 0.3, 0.5};
+    int status = 0; // a fault-free bus is deterministic, anything short of perfect there is a bug
+    io_service_t framebuffer = 1; // any non-zero id will do, the simulated bus ignores it
+    uint64_t *latency = calloc(ops, sizeof(*latency));
+    if (!latency) {
+        MyLog(@"E: Failed to allocate %lu soak samples!", ops);
+        return -1;
+    }
+
+    // make the simulated bus cost what a real one does, unless -W asked for another reply delay
+    if (DDCDelayBase <= 1)
+        DDCDelayBase = 40000000; // DDC/CI hosts give a monitor 40msec to prepare a Get VCP Feature reply
+    DDCSimulatedByteTime = 90; // 100kHz I2C
+    DDCSimulatedTimeout = 50000;
+    DDCSimulatedSettleTime = 60000;
+    long deadline = confirmDeadline > 0 ? confirmDeadline : 500000;
+    MyLog(@"I: soak bus: %ldns reply delay, %ldus per byte, %ldus dropped-reply timeout, writes settle within %ldus",
+          DDCDelayBase, DDCSimulatedByteTime, DDCSimulatedTimeout, DDCSimulatedSettleTime);
+
+    for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+        NSUInteger ok = 0, failed = 0, false_accepts = 0;
+        DDCFaultRate = rates[r];
+        bzero(DDCFaultsInjected, sizeof(DDCFaultsInjected));
+
+        uint64_t start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+        for (NSUInteger n = 0; n < ops; n++) {
+            struct DDCReadCommand command = {};
+            command.control_id = arc4random_uniform(256);
+            UInt16 max = arc4random_uniform(0x10000);
+            UInt16 expected = arc4random_uniform(max + 1);
+            DDCSimulatedSet(command.control_id, expected, max);
+
+            uint64_t t = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+            bool success = DDCRead(framebuffer, &command);
+            latency[n] = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - t;
+
+            if (!success)
+                failed++;
+            else if (command.current_value != expected || command.max_value != max)
+                false_accepts++; // passed validation but carried the wrong value
+            else
+                ok++;
+        }
+        double elapsed = (clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start) / 1e9;
+
+        qsort(latency, ops, sizeof(*latency), compareLatency);
+        MyLog(@"I: soak fault-rate %.2f: %lu ops, %lu ok, %lu failed, %lu false-accepts (%.3f%%), goodput %.1f ops/s, latency p50 %.1fms p99 %.1fms max %.1fms",
+              DDCFaultRate, ops, ok, failed, false_accepts, 100.0 * false_accepts / ops, ok / elapsed,
+              latency[ops / 2] / 1e6, latency[MIN(ops * 99 / 100, ops - 1)] / 1e6, latency[ops - 1] / 1e6);
+        MyLog(@"I: soak   injected: %llu dropped, %llu checksum, %llu opcode, %llu truncated, %llu unsupported",
+              DDCFaultsInjected[kDDCFaultDrop], DDCFaultsInjected[kDDCFaultChecksum], DDCFaultsInjected[kDDCFaultOpcode],
+              DDCFaultsInjected[kDDCFaultTruncate], DDCFaultsInjected[kDDCFaultUnsupported]);
+        if (DDCFaultRate == 0 && ok != ops) {
+            MyLog(@"E: soak: %lu of %lu reads went wrong on a fault-free bus!", ops - ok, ops);
+            status = 1;
+        }
+
+        // confirmed writes: how soon the monitor is seen to have applied them
+        NSUInteger settled = 0, timeouts = 0, unsent = 0;
+        for (NSUInteger n = 0; n < ops; n++) {
+            struct DDCWriteCommand command = {};
+            command.control_id = arc4random_uniform(256);
+            command.new_value = arc4random_uniform(0x10000);
+            DDCSimulatedSet(command.control_id, command.new_value ^ 1, 0xFFFF); // the write has to change something
+
+            long settle_time = 0;
+            bool confirmed = false;
+            if (!DDCWriteConfirmed(framebuffer, &command, deadline, &settle_time, &confirmed))
+                unsent++;
+            else if (!confirmed)
+                timeouts++;
+            else
+                latency[settled++] = settle_time * 1000ULL;
+        }
+        if (DDCFaultRate == 0 && settled != ops) {
+            MyLog(@"E: soak: %lu of %lu confirmed writes did not settle on a fault-free bus!", ops - settled, ops);
+            status = 1;
+        }
+
+        qsort(latency, settled, sizeof(*latency), compareLatency);
+        MyLog(@"I: soak   confirmed writes: %lu settled, %lu timed out, %lu unsent (%ldus deadline), settle p50 %.1fms p99 %.1fms max %.1fms",
+              settled, timeouts, unsent, deadline,
+              settled ? latency[settled / 2] / 1e6 : 0, settled ? latency[MIN(settled * 99 / 100, settled - 1)] / 1e6 : 0,
+              settled ? latency[settled - 1] / 1e6 : 0);
+
+        // tables: fragmented reads and writes of up to 256 bytes, including empty ones
+        NSUInteger tables = MAX(ops / 10, 1);
+        NSUInteger read_ok = 0, read_failed = 0, read_corrupt = 0, write_ok = 0, write_failed = 0, write_corrupt = 0;
+        for (NSUInteger n = 0; n < tables; n++) {
+            UInt8 data[512];
+            UInt8 control_id = arc4random_uniform(256);
+            UInt16 length = arc4random_uniform(257);
+            arc4random_buf(DDCSimulatedTable[control_id], length);
+            DDCSimulatedTableLength[control_id] = length;
+
+            struct DDCTableCommand command = {};
+            command.control_id = control_id;
+            command.length = sizeof(data);
+            command.data = data;
+            if (!DDCTableRead(framebuffer, &command))
+                read_failed++;
+            else if (command.truncated || command.length != length || memcmp(data, DDCSimulatedTable[control_id], length))
+                read_corrupt++;
+            else
+                read_ok++;
+
+            arc4random_buf(data, length);
+            command.length = length;
+            DDCSimulatedTableLength[control_id] = 0;
+            if (!DDCTableWrite(framebuffer, &command))
+                write_failed++;
+            else if (DDCSimulatedTableLength[control_id] != length || memcmp(data, DDCSimulatedTable[control_id], length))
+                write_corrupt++;
+            else
+                write_ok++;
+        }
+        MyLog(@"I: soak   tables: %lu read ok, %lu failed, %lu corrupt; %lu written ok, %lu failed, %lu corrupt",
+              read_ok, read_failed, read_corrupt, write_ok, write_failed, write_corrupt);
+        if (DDCFaultRate == 0 && (read_ok != tables || write_ok != tables)) {
+            MyLog(@"E: soak: %lu of %lu table reads and %lu of %lu table writes went wrong on a fault-free bus!",
+                  tables - read_ok, tables, tables - write_ok, tables);
+            status = 1;
+        }
+    }
+    free(latency);
+    return status;
+}
+#endif
+
 /* Main function */
 int main(int argc, const char * argv[])
 {
@@ -214,11 +436,18 @@ int main(int argc, const char * argv[])
         NSUInteger displayId = -1;
         NSUInteger command_interval = 100000;
         BOOL dump_values = NO;
+#ifdef SIMULATE
+        NSUInteger soak_ops = 0;
+#endif
 
         NSString *HelpString = @"Usage:\n"
         @"ddcctl \t-d <1-..>  [display#]\n"
         @"\t-w <0-..>  [delay in usecs between settings]\n"
         @"\t-W <0-..>  [timeout in nanosecs for replies]\n"
+        @"\t-C <1-10000000> [confirm writes by reading them back, deadline in usecs]\n"
+#ifdef SIMULATE
+        @"\t-soak <1-1000000> [soak DDC reads on a simulated noisy bus]\n"
+#endif
         @"\n"
         @"----- Basic settings -----\n"
         @"\t-b <1-..>  [brightness]\n"
@@ -239,6 +468,7 @@ int main(int argc, const char * argv[])
         @"\t-gg <1-..>  [green gain]\n"
         @"\t-bg <1-..>  [blue gain]\n"
         @"\t-rrgb       [reset color]\n"
+        @"\t-t <vcp> <hex|?>  [write or read a table control, e.g. -t 0x73 ?]\n"
         @"\n"
         @"----- Setting grammar -----\n"
         @"\t-X ?       (query value of setting X)\n"
@@ -296,6 +526,21 @@ int main(int argc, const char * argv[])
                 [actions setObject:@[@RESET_COLOR, @"1"] forKey:@"rrgb"];
             }
 
+            else if (!strcmp(argv[i], "-t")) {
+                i++;
+                if (i >= argc) break;
+                // decimal, or hex with a 0x prefix; never octal
+                char *end;
+                long table_id = strtol(argv[i], &end, strncasecmp(argv[i], "0x", 2) ? 10 : 16);
+                if (end == argv[i] || *end || table_id < 0 || table_id > 0xFF) {
+                    NSLog(@"Invalid VCP code: %@ (0-255 or 0x00-0xFF)", [[NSString alloc] initWithUTF8String:argv[i]]);
+                    return -1;
+                }
+                i++;
+                if (i >= argc) break;
+                [actions setObject:@[[NSNumber numberWithLong:table_id], [[NSString alloc] initWithUTF8String:argv[i]]] forKey:@"t"];
+            }
+
             else if (!strcmp(argv[i], "-D")) {
                 dump_values = YES;
             }
@@ -370,6 +615,30 @@ int main(int argc, const char * argv[])
                 DDCDelayBase = atoi(argv[i]);
             }
 
+            else if (!strcmp(argv[i], "-C")) {
+                i++;
+                if (i >= argc) break;
+                char *end;
+                confirmDeadline = strtol(argv[i], &end, 10);
+                if (end == argv[i] || *end || confirmDeadline < 1 || confirmDeadline > 10000000) {
+                    NSLog(@"Invalid confirm deadline: %@ (1-10000000 usecs)", [[NSString alloc] initWithUTF8String:argv[i]]);
+                    return -1;
+                }
+            }
+
+#ifdef SIMULATE
+            else if (!strcmp(argv[i], "-soak")) {
+                i++;
+                if (i >= argc) break;
+                char *end;
+                long ops = strtol(argv[i], &end, 10);
+                if (*end || ops < 1 || ops > 1000000) {
+                    NSLog(@"Invalid soak count: %@ (1-1000000)", [[NSString alloc] initWithUTF8String:argv[i]]);
+                    return -1;
+                }
+                soak_ops = ops;
+            }
+#endif
 #ifdef OSD
             else if (!strcmp(argv[i], "-O")) {
                 useOsd = YES;
@@ -397,6 +666,12 @@ int main(int argc, const char * argv[])
             }
         }
 
+#ifdef SIMULATE
+        if (soak_ops > 0) {
+            return soak(soak_ops);
+        }
+#endif
+
         if (0 >= displayId || displayId > [_displayIDs count]) {
             // no display id given, nothing left to do!
             NSLog(@"%@", HelpString);
@@ -462,24 +737,33 @@ int main(int argc, const char * argv[])
             NSInteger control_id = [valueArray[0] intValue];
             NSString *argval = valueArray[1];
             MyLog(@"D: action: %@: %@", argname, argval);
-
-            if (control_id > -1) {
+            bool settled = false;
+
+            if ([argname isEqualToString:@"t"]) {
+                // table controls move their whole value in one go
+                if ([argval hasPrefix:@"?"]) {
+                    getTable(framebuffer, control_id);
+                } else {
+                    setTable(framebuffer, control_id, argval);
+                }
+            } else if (control_id > -1) {
                 // this is a valid monitor control
                 NSString *argval_num = [argval stringByTrimmingCharactersInSet:[NSCharacterSet characterSetWithCharactersInString:@"-+"]]; // look for relative setting ops
                 if ([argval hasPrefix:@"+"] || [argval hasPrefix:@"-"]) { // +/-NN relative
-                    getSetControl(framebuffer, control_id, argval_num, [argval substringToIndex:1]);
+                    settled = getSetControl(framebuffer, control_id, argval_num, [argval substringToIndex:1]);
                 } else if ([argval hasSuffix:@"+"] || [argval hasSuffix:@"-"]) { // NN+/- relative
                     // read, calculate, then write
-                    getSetControl(framebuffer, control_id, argval_num, [argval substringFromIndex:argval.length - 1]);
+                    settled = getSetControl(framebuffer, control_id, argval_num, [argval substringFromIndex:argval.length - 1]);
                 } else if ([argval hasPrefix:@"?"]) {
                     // read current setting
                     getControl(framebuffer, control_id);
                 } else if (argval_num == argval) {
                     // write fixed setting
-                    setControl(framebuffer, control_id, [argval intValue]);
+                    settled = setControl(framebuffer, control_id, [argval intValue]);
                 }
             }
-            usleep(command_interval); // stagger comms to these wimpy I2C mcu's
+            if (!settled)
+                usleep(command_interval); // stagger comms to these wimpy I2C mcu's
         }];
         // done with all actions, release display's framebuffer
         IOObjectRelease(framebuffer);